@@ -0,0 +1,85 @@
+/*
+	Differential test of the block engine (RunThreaded) against the
+	reference interpreter Machine::Do.
+
+	Random memory images are run on both with random step limits, IP and
+	OV on all three geometries; every image is also code, so stores into
+	the program (self-modifying code, invalidated blocks) happen all the
+	time. Small runs keep addresses below 8 so programs loop and rewrite
+	themselves, full runs spread over the whole memory and use address
+	bits above ADDRBITS.
+
+	g++ -std=c++17 -O2 -pthread -o difftest difftest.cpp
+	difftest [seed [scale]]   - scale multiplies the number of programs
+
+	Exit code 0 - no mismatches, 1 - mismatches found.
+*/
+
+#define main tinyac_main
+#include "tinyac.cpp"
+#undef main
+
+#include <random>
+
+template <class G>
+static long Test(const char* name, long count, std::mt19937_64& rnd, bool small) {
+	typedef typename G::Word Word;
+	const int span = small ? 8 : G::MEMSIZE; // используемые адреса
+	auto addr = [&]() {
+		unsigned long long a = rnd() % span;
+		// биты поля выше адреса должны игнорироваться
+		if (rnd() % 8 == 0) a |= (rnd() * G::MEMSIZE) & ((1ULL << G::FIELDBITS) - 1);
+		return a;
+	};
+	long bad {0};
+	for (long t = 0; t < count; t++) {
+		Machine<G> a;
+		for (int i = 0; i < span; i++) {
+			unsigned long long w;
+			switch (rnd() % 4) {
+				case 0: // произвольное слово
+					w = rnd();
+					break;
+				case 1: // малые числа
+					w = (unsigned long long)((long long)(rnd() % 21) - 10);
+					break;
+				case 2: // команда, изредка неизвестная
+					w = ((rnd() % (rnd() % 5 == 0 ? 16 : 7)) << G::CODESHIFT) | (addr() << (2 * G::FIELDBITS)) | (addr() << G::FIELDBITS) | addr();
+					break;
+				default: // границы слова для переполнений
+					w = (unsigned long long)(long long)(rnd() % 2 ? G::WMAX - Word(rnd() % 3) : G::WMIN + Word(rnd() % 3));
+			}
+			a.memory[i] = Word(w);
+		}
+		a.IP = Word(rnd() % span);
+		a.OV = rnd() % 3 == 0;
+		Machine<G> b = a;
+		unsigned long long limit = rnd() % 3 ? rnd() % 300 : 0;
+		if (limit == 0) limit = rnd() % 2 ? 5000 : 1;
+		bool h1 = a.Do(limit);
+		bool h2 = RunThreaded<G>(b, limit);
+		bool same = h1 == h2 && a.halted == b.halted && a.steps == b.steps && a.IP == b.IP && a.IR == b.IR
+		            && a.OV == b.OV && a.D0 == b.D0;
+		for (int i = 0; i < G::MEMSIZE; i++) same = same && a.memory[i] == b.memory[i];
+		for (int i = 0; i < 3; i++) same = same && a.PR[i] == b.PR[i];
+		if (!same) {
+			if (bad < 3) std::cout << name << ": mismatch in program " << t << ", limit " << limit << std::endl;
+			bad++;
+		}
+	}
+	std::cout << name << ": " << count << " programs, " << bad << " mismatches" << std::endl;
+	return bad;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned long long seed = argc > 1 ? strtoull(argv[1], NULL, 10) : 11;
+	long scale = argc > 2 ? std::max(1L, strtol(argv[2], NULL, 10)) : 1;
+	std::mt19937_64 rnd(seed);
+	long bad {0};
+	bad += Test<Classic>("classic", 500000 * scale, rnd, true);
+	bad += Test<Extended>("256 small", 100000 * scale, rnd, true);
+	bad += Test<Extended>("256", 20000 * scale, rnd, false);
+	bad += Test<Extended4K>("4096 small", 20000 * scale, rnd, true);
+	bad += Test<Extended4K>("4096", 3000 * scale, rnd, false);
+	return bad ? 1 : 0;
+}
@@ -27,21 +27,50 @@
 */
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <array>
+#include <set>
+#include <queue>
 #include <cctype>
 #include <cstdio>
 #include <algorithm>
-#include <windows.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <limits.h>
+#include <limits>
+#include <type_traits>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#define Sleep(ms) usleep((ms) * 1000)
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <csignal>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#define HAVE_UNIX_SOCKETS
+#endif
 
-#define Word int16_t
 #define Byte int8_t
-#define MEMSIZE 8
-#define LASTADDR 7
 
 #define cmCOPY 0 // copy
 #define cmADD  1 // add
@@ -51,16 +80,7 @@
 #define cmMPY  5 // multiply
 #define cmTRGT 6 // trace if greater
 #define cmPRST 7 // print & stop
-
-typedef union {
-	struct {
-		int8_t byte3 : 4;
-		int8_t byte2 : 4;
-		int8_t byte1 : 4;
-		int8_t byte0 : 4;
-	};
-	Word word;
-} _WORD;
+#define cmHALT 8 // unknown instruction, stop without output
 
 void print_char(char c) {
 	unsigned char mask = 128;
@@ -71,23 +91,571 @@ void print_char(char c) {
 	}
 }
 
-class TINYAC {
+/*
+	Machine geometry: address width and machine word type. Memory has
+	2^ADDRBITS words. The instruction code takes the upper 4 bits of a
+	word, the rest is split into three equal address fields; field bits
+	above ADDRBITS are ignored, as bits 11, 7 and 3 of the classic word.
+*/
+template <int ADDRBITS, typename WORD>
+struct Geometry {
+	typedef WORD Word;
+	typedef typename std::make_unsigned<WORD>::type UWord;
+	static constexpr int WORDBITS  = sizeof(Word) * 8;
+	static constexpr int MEMSIZE   = 1 << ADDRBITS;
+	static constexpr int LASTADDR  = MEMSIZE - 1;
+	static constexpr int FIELDBITS = (WORDBITS - 4) / 3;
+	static constexpr int CODESHIFT = WORDBITS - 4;
+	static constexpr Word WMAX = std::numeric_limits<Word>::max();
+	static constexpr Word WMIN = std::numeric_limits<Word>::min();
+	static_assert(FIELDBITS >= ADDRBITS, "address does not fit in the address field");
+
+	static constexpr int OpCode(Word w) { return int(UWord(w) >> CODESHIFT) & 0xF; }
+	static constexpr int Addr1(Word w)  { return int(UWord(w) >> (2 * FIELDBITS)) & LASTADDR; }
+	static constexpr int Addr2(Word w)  { return int(UWord(w) >> FIELDBITS) & LASTADDR; }
+	static constexpr int Addr3(Word w)  { return int(UWord(w)) & LASTADDR; }
+	static constexpr Word Encode(int code, int a1, int a2, int a3) {
+		return Word((UWord(code) << CODESHIFT) | (UWord(a1) << (2 * FIELDBITS)) | (UWord(a2) << FIELDBITS) | UWord(a3));
+	}
+};
+
+typedef Geometry<3, int16_t>  Classic;  // "Krokha": 8 words of 16 bits
+typedef Geometry<8, int32_t>  Extended; // 256 words of 32 bits
+typedef Geometry<12, int64_t> Extended4K; // 4096 words of 64 bits
+
+/*
+	Execution core. Everything here is constexpr, so the same code runs
+	programs in the console, in batches and at compile time:
+
+		constexpr auto m = Run<Classic>(" ADD 6 7 5 \n PRST 6 7 5 \n ... ", 100);
+		static_assert(m.halted && m.PR[2] == 3);
+
+	Codes 8..15 stop the machine.
+*/
+
+template <typename Word>
+constexpr bool AddOverflow(Word a, Word b) {
+	constexpr Word WMAX = std::numeric_limits<Word>::max(), WMIN = std::numeric_limits<Word>::min();
+	return ((b > 0) && (a > (WMAX - b))) || ((b < 0) && (a < (WMIN - b)));
+}
+
+template <typename Word>
+constexpr bool SubOverflow(Word a, Word b) {
+	constexpr Word WMAX = std::numeric_limits<Word>::max(), WMIN = std::numeric_limits<Word>::min();
+	return (b > 0 && a < WMIN + b) || (b < 0 && a > WMAX + b);
+}
+
+template <typename Word>
+constexpr bool DivOverflow(Word a, Word b) {
+	return (a == std::numeric_limits<Word>::min()) && (b == -1);
+}
+
+template <typename Word>
+constexpr bool MpyOverflow(Word a, Word b) {
+	constexpr Word WMAX = std::numeric_limits<Word>::max(), WMIN = std::numeric_limits<Word>::min();
+	if (a > 0) {  /* a is positive */
+		if (b > 0) return a > (WMAX / b);     /* a and b are positive */
+		return b < (WMIN / a);                /* a positive, b nonpositive */
+	}
+	if (b > 0) return a < (WMIN / b);         /* a nonpositive, b positive */
+	return (a != 0) && (b < (WMAX / a));      /* a and b are nonpositive */
+}
+
+// product modulo word size, as the machine stores it on overflow
+template <typename Word>
+constexpr Word MpyWord(Word a, Word b) {
+	return Word(uint64_t(a) * uint64_t(b));
+}
+
+template <class G>
+struct Machine {
+	typedef typename G::Word Word;
+	bool OV {false}; //overflow state 		OV/NO
+	bool D0 {false}; //division by zero		D0/ND
+	Word IR {0}; //instruction register
+	Word IP {0}; //instruction pointer
+	Word memory[G::MEMSIZE] {};
+	Word PR[3] {};    //вывод последней PRST
+	bool halted {false};
+	unsigned long long steps {0}; //шагов в последнем Do
+
+	constexpr void Reset();
+	constexpr int  Step();
+	constexpr bool Do(unsigned long long maxSteps);
+};
+
+template <class G>
+constexpr void Machine<G>::Reset() {
+	*this = Machine();
+}
+
+// returns instruction code or cmHALT
+template <class G>
+constexpr int Machine<G>::Step() {
+	IR = memory[IP];
+	IP++; if(IP > G::LASTADDR) IP = 0; // достигли конца памяти, переходим на 0
+	const int a1 = G::Addr1(IR), a2 = G::Addr2(IR), a3 = G::Addr3(IR);
+	const Word x = memory[a1], y = memory[a2];
+	switch (G::OpCode(IR)) {
+		case cmCOPY:
+			memory[a3] = x;
+			return cmCOPY;
+		case cmADD:
+			if (AddOverflow(x, y)) OV = true;
+			else memory[a3] = x + y;
+			return cmADD;
+		case cmDIV:
+			if (y == 0) D0 = true;
+			else if (DivOverflow(x, y)) OV = true;
+			else memory[a3] = x / y;
+			return cmDIV;
+		case cmSUB:
+			if (SubOverflow(x, y)) OV = true;
+			else memory[a3] = x - y;
+			return cmSUB;
+		case cmTREQ:
+			if (x == y) IP = a3;
+			return cmTREQ;
+		case cmMPY:
+			if (MpyOverflow(x, y)) OV = true;
+			memory[a3] = MpyWord(x, y);
+			return cmMPY;
+		case cmTRGT:
+			if (x > y) IP = a3;
+			return cmTRGT;
+		case cmPRST:
+			PR[0] = x;
+			PR[1] = y;
+			PR[2] = memory[a3];
+			return cmPRST;
+	}
+	return cmHALT; //неизвестная инструкция - STOP!
+}
+
+// maxSteps = 0 - без ограничения
+template <class G>
+constexpr bool Machine<G>::Do(unsigned long long maxSteps) {
+	steps = 0;
+	halted = false;
+	while (maxSteps == 0 || steps < maxSteps) {
+		steps++;
+		if (Step() >= cmPRST) {
+			halted = true;
+			break;
+		}
+	}
+	return halted;
+}
+
+/*
+	Assembler. A line is "MNEMONIC a1 a2 a3", "DEFD decimal" or
+	"DEFH hex"; mnemonics are case insensitive, text after ';' is
+	a comment.
+*/
+
+constexpr bool IsBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+constexpr std::string_view NextToken(std::string_view& line) {
+	size_t b = 0;
+	while (b < line.size() && IsBlank(line[b])) b++;
+	size_t e = b;
+	while (e < line.size() && !IsBlank(line[e])) e++;
+	std::string_view token = line.substr(b, e - b);
+	line.remove_prefix(e);
+	return token;
+}
+
+constexpr bool SameText(std::string_view token, std::string_view upper) {
+	if (token.size() != upper.size()) return false;
+	for (size_t i = 0; i < token.size(); i++) {
+		char c = token[i];
+		if (c >= 'a' && c <= 'z') c = c - 'a' + 'A';
+		if (c != upper[i]) return false;
+	}
+	return true;
+}
+
+// hexadecimal numbers are taken as 64-bit words: ffffffffffffffff == -1
+constexpr bool ParseNumber(std::string_view token, int base, long long& value) {
+	bool minus = false;
+	if (base == 10 && !token.empty() && (token[0] == '-' || token[0] == '+')) {
+		minus = token[0] == '-';
+		token.remove_prefix(1);
+	}
+	while (token.size() > 1 && token[0] == '0') token.remove_prefix(1); //ведущие нули
+	if (token.empty() || token.size() > (base == 10 ? 19u : 16u)) return false;
+	unsigned long long u = 0;
+	for (char c : token) {
+		int d = (c >= '0' && c <= '9') ? c - '0'
+		      : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+		      : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : 99;
+		if (d >= base) return false;
+		u = u * base + d;
+	}
+	if (base == 10 && u > (minus ? 1ULL << 63 : (1ULL << 63) - 1)) return false;
+	value = (long long)(minus ? 0 - u : u);
+	return true;
+}
+
+// number typed in the console or a script: hex if started from zero
+constexpr bool InputNumber(std::string_view token, long long& value) {
+	return ParseNumber(token, (token.size() > 1 && token[0] == '0') ? 16 : 10, value);
+}
+
+template <class G>
+constexpr bool AssembleLine(std::string_view line, typename G::Word& word) {
+	typedef typename G::Word Word;
+	typedef typename G::UWord UWord;
+	constexpr std::string_view mnemonics[] = {"COPY", "ADD", "DIV", "SUB", "TREQ", "MPY", "TRGT", "PRST"};
+	line = line.substr(0, line.find(';'));
+	std::string_view name = NextToken(line);
+	std::string_view arg[4];
+	int n = 0;
+	for (std::string_view t = NextToken(line); !t.empty(); t = NextToken(line)) {
+		if (n == 4) return false;
+		arg[n++] = t;
+	}
+	long long v[3] = {0, 0, 0};
+	if (SameText(name, "DEFD")) {
+		if (n != 1 || !ParseNumber(arg[0], 10, v[0]) || v[0] < G::WMIN || v[0] > G::WMAX) return false;
+		word = Word(v[0]);
+		return true;
+	}
+	if (SameText(name, "DEFH")) {
+		if (n != 1 || !ParseNumber(arg[0], 16, v[0])) return false;
+		if ((G::WORDBITS < 64) && (unsigned long long)v[0] > (unsigned long long)UWord(-1)) return false;
+		word = Word(UWord(v[0]));
+		return true;
+	}
+	for (int code = cmCOPY; code <= cmPRST; code++) {
+		if (!SameText(name, mnemonics[code])) continue;
+		if (n != 3) return false;
+		for (int i = 0; i < 3; i++)
+			if (!ParseNumber(arg[i], 10, v[i]) || v[i] < 0 || v[i] >= (1LL << G::FIELDBITS)) return false;
+		word = G::Encode(code, v[0], v[1], v[2]);
+		return true;
+	}
+	return false;
+}
+
+template <class G>
+struct Image {
+	typename G::Word memory[G::MEMSIZE] {};
+	int error {0}; //номер строки с ошибкой, 0 - без ошибок
+};
+
+// one instruction or value per line from address 0, empty lines skipped
+template <class G>
+constexpr Image<G> AssembleText(std::string_view text) {
+	Image<G> img;
+	int org = 0;
+	int lineNo = 0;
+	while (!text.empty() && img.error == 0) {
+		size_t nl = text.find('\n');
+		std::string_view line = text.substr(0, nl);
+		text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+		lineNo++;
+		std::string_view rest = line.substr(0, line.find(';'));
+		if (NextToken(rest).empty()) continue;
+		if (org > G::LASTADDR || !AssembleLine<G>(line, img.memory[org])) img.error = lineNo;
+		org++;
+	}
+	return img;
+}
+
+template <class G>
+constexpr Machine<G> Run(std::string_view text, unsigned long long maxSteps) {
+	Machine<G> m;
+	Image<G> img = AssembleText<G>(text);
+	if (img.error != 0) return m;
+	for (int i = 0; i < G::MEMSIZE; i++) m.memory[i] = img.memory[i];
+	m.Do(maxSteps);
+	return m;
+}
+
+constexpr const char* TEST_PROGRAM =
+	"ADD  6 7 5 ;P=A+B\n"
+	"ADD  5 5 5 ;P=P+P\n"
+	"PRST 6 7 5 ;print A B P\n"
+	"DEFD 0\n"
+	"DEFD 0\n"
+	"DEFD 0     ;P\n"
+	"DEFD 2     ;A\n"
+	"DEFD 1     ;B\n";
+
+constexpr const char* MPY_300_300 = "MPY 6 6 5\nPRST 5 5 5\nDEFD 0\nDEFD 0\nDEFD 0\nDEFD 0\nDEFD 300";
+
+static_assert(AssembleText<Classic>(TEST_PROGRAM).memory[0] == 0x1675);
+static_assert(Run<Classic>(TEST_PROGRAM, 0).PR[0] == 2 && Run<Classic>(TEST_PROGRAM, 0).PR[1] == 1 && Run<Classic>(TEST_PROGRAM, 0).PR[2] == 6);
+static_assert(Run<Classic>("DIV 6 7 5\nPRST 5 5 5\nDEFD 0\nDEFD 0\nDEFD 0\nDEFD 0\nDEFD 1\nDEFD 0", 0).D0);
+static_assert(Run<Classic>(MPY_300_300, 0).OV);
+static_assert(!Run<Classic>("TREQ 0 0 0", 1000).halted);
+static_assert(AssembleText<Extended>("ADD 200 201 255").memory[0] == 0x132192FF);
+static_assert(Run<Extended>(TEST_PROGRAM, 0).PR[2] == 6);
+static_assert(!Run<Extended>(MPY_300_300, 0).OV && Run<Extended>(MPY_300_300, 0).PR[0] == 90000);
+static_assert(Run<Extended4K>(TEST_PROGRAM, 0).PR[2] == 6);
+
+/*
+	Threaded-code engine (computed goto, GCC and Clang). On first entry
+	at an address the run of cells up to the next TREQ, TRGT, PRST or
+	unknown instruction (or up to the last cell) is compiled into a basic
+	block: every cell gets a handler address, its operands and the number
+	of steps from it to the end of the block. An arithmetic instruction
+	or COPY followed by the closing TREQ/TRGT is fused into one handler.
+	The step budget is checked once on block entry; a block that doesn't
+	fit into the rest of the budget is finished by Machine::Do.
+	Handlers inside a block jump straight to the next cell, branches keep
+	pointers to both target cells and enter the next block directly.
+
+	A store into a compiled cell ends the block after the storing
+	instruction, returns the unused steps and drops the blocks that
+	include that cell, so self-modifying programs run exactly as with
+	Machine::Step. Other compilers fall back to Machine::Do.
+*/
+template <class G>
+bool RunThreaded(Machine<G>& m, unsigned long long maxSteps) {
+#if defined(__GNUC__)
+	typedef typename G::Word Word;
+	typedef typename std::conditional<(G::MEMSIZE < 128), int8_t, int16_t>::type Addr;
+	struct Cell {
+		const void* handler;
+		Cell* to;   //переход TREQ/TRGT (или слитого ветвления)
+		Cell* fall; //ячейка после ветвления
+		Word word, word2;
+		Addr a1, a2, a3;
+		Addr b1, b2; //операнды слитого ветвления
+		Addr len;    //шагов до конца блока, 0 - ячейка не скомпилирована
+	};
+	static const void* const singles[16] = {
+		&&opCOPY, &&opADD, &&opDIV, &&opSUB, &&opTREQ, &&opMPY, &&opTRGT, &&opPRST,
+		&&opHALT, &&opHALT, &&opHALT, &&opHALT, &&opHALT, &&opHALT, &&opHALT, &&opHALT
+	};
+	static const void* const fused[8][2] = {
+		{&&COPY_TREQ, &&COPY_TRGT}, {&&ADD_TREQ, &&ADD_TRGT}, {&&DIV_TREQ, &&DIV_TRGT},
+		{&&SUB_TREQ, &&SUB_TRGT}, {NULL, NULL}, {&&MPY_TREQ, &&MPY_TRGT}, {NULL, NULL}, {NULL, NULL}
+	};
+	// последняя ячейка - ограничитель за концом памяти
+	static thread_local Cell big[G::MEMSIZE > 256 ? G::MEMSIZE + 1 : 1]; //не помещается в стек
+	Cell small[G::MEMSIZE > 256 ? 1 : G::MEMSIZE + 1];
+	Cell* const code = G::MEMSIZE > 256 ? big : small;
+	Cell* c = &code[m.IP & G::LASTADDR];
+	Word* mem = m.memory;
+	const unsigned long long limit = maxSteps ? maxSteps : ULLONG_MAX;
+	unsigned long long left = limit;
+	Word ir = m.IR;
+	int dirty = -1; //скомпилированная ячейка, в которую была запись
+	bool halted = false;
+
+	for (int i = 0; i <= G::MEMSIZE; i++) code[i].len = 0;
+	code[G::MEMSIZE].handler = &&wrap;
+
+#define STORE(d, v) do { mem[d] = (v); if (code[d].len != 0) dirty = (d); } while (0)
+#define DO_COPY(a, b, d) STORE(d, mem[a])
+#define DO_ADD(a, b, d) do { Word x = mem[a], y = mem[b]; if (AddOverflow(x, y)) m.OV = true; else STORE(d, x + y); } while (0)
+#define DO_SUB(a, b, d) do { Word x = mem[a], y = mem[b]; if (SubOverflow(x, y)) m.OV = true; else STORE(d, x - y); } while (0)
+#define DO_DIV(a, b, d) do { Word x = mem[a], y = mem[b]; \
+		if (y == 0) m.D0 = true; else if (DivOverflow(x, y)) m.OV = true; else STORE(d, x / y); } while (0)
+#define DO_MPY(a, b, d) do { Word x = mem[a], y = mem[b]; if (MpyOverflow(x, y)) m.OV = true; STORE(d, MpyWord(x, y)); } while (0)
+#define IS_TREQ(a, b) (mem[a] == mem[b])
+#define IS_TRGT(a, b) (mem[a] > mem[b])
+// вход в блок; у каждого перехода свой косвенный переход на обработчик
+#define ENTER(p) do { c = (p); \
+		if (c->len == 0 || left < (unsigned long long)c->len) goto block; \
+		left -= c->len; \
+		goto *c->handler; } while (0)
+#define SINGLE(OP) op##OP: \
+		DO_##OP(c->a1, c->a2, c->a3); \
+		if (dirty >= 0) goto modified; \
+		c++; \
+		goto *c->handler;
+#define BRANCH(OP) op##OP: \
+		ir = c->word; \
+		if (IS_##OP(c->a1, c->a2)) ENTER(c->to); \
+		ENTER(c->fall);
+#define FUSED(OP, BR) OP##_##BR: \
+		DO_##OP(c->a1, c->a2, c->a3); \
+		ir = c->word2; \
+		if (dirty >= 0) { \
+			c = IS_##BR(c->b1, c->b2) ? c->to : c->fall; \
+			goto invalidate; \
+		} \
+		if (IS_##BR(c->b1, c->b2)) ENTER(c->to); \
+		ENTER(c->fall);
+
+	ENTER(c);
+block:
+	if (c->len != 0) goto slow;
+	{
+		// блок заканчивается на TREQ, TRGT, PRST, неизвестной инструкции или последней ячейке
+		const int ip = int(c - code);
+		int end = ip;
+		while (end < G::LASTADDR && G::OpCode(mem[end]) != cmTREQ && G::OpCode(mem[end]) < cmTRGT) end++;
+		for (int i = end; i >= ip; i--) {
+			Cell& k = code[i];
+			Word w = mem[i];
+			int op = G::OpCode(w);
+			k.word = w;
+			k.a1 = G::Addr1(w); k.a2 = G::Addr2(w); k.a3 = G::Addr3(w);
+			k.to = &code[k.a3];
+			k.fall = &code[(i + 1) & G::LASTADDR];
+			k.handler = singles[op];
+			k.len = Addr(i == end ? 1 : code[i + 1].len + 1);
+			// слияние с ветвлением, если инструкция не пишет в его ячейку
+			if (i == end - 1 && op < 8 && fused[op][0] != NULL && k.a3 != end) {
+				const Cell& br = code[end];
+				int op2 = G::OpCode(br.word);
+				if (op2 == cmTREQ || op2 == cmTRGT) {
+					k.word2 = br.word;
+					k.b1 = br.a1; k.b2 = br.a2;
+					k.to = br.to;
+					k.fall = br.fall;
+					k.handler = fused[op][op2 == cmTRGT];
+				}
+			}
+		}
+		ENTER(c);
+	}
+	SINGLE(COPY)
+	SINGLE(ADD)
+	SINGLE(DIV)
+	SINGLE(SUB)
+	SINGLE(MPY)
+	BRANCH(TREQ)
+	BRANCH(TRGT)
+	FUSED(COPY, TREQ) FUSED(COPY, TRGT)
+	FUSED(ADD, TREQ)  FUSED(ADD, TRGT)
+	FUSED(DIV, TREQ)  FUSED(DIV, TRGT)
+	FUSED(SUB, TREQ)  FUSED(SUB, TRGT)
+	FUSED(MPY, TREQ)  FUSED(MPY, TRGT)
+wrap:
+	// блок дошёл до последней ячейки без ветвления
+	ir = code[G::LASTADDR].word;
+	ENTER(code);
+modified:
+	// запись в код внутри блока: вернуть невыполненные шаги
+	ir = c->word;
+	left += (c + 1)->len;
+	c = c + 1 == code + G::MEMSIZE ? code : c + 1;
+invalidate:
+	for (int s = dirty; s >= 0 && code[s].len != 0 && (s == dirty || s + code[s].len > dirty); s--)
+		code[s].len = 0;
+	dirty = -1;
+	ENTER(c);
+slow:
+	// блок не помещается в остаток шагов
+	m.IP = Word(c - code);
+	m.IR = ir;
+	if (left > 0) {
+		halted = m.Do(left);
+		left -= m.steps;
+	}
+	m.steps = limit - left;
+	m.halted = halted;
+	return halted;
+opPRST:
+	m.PR[0] = mem[c->a1];
+	m.PR[1] = mem[c->a2];
+	m.PR[2] = mem[c->a3];
+opHALT:
+	halted = true;
+#undef STORE
+#undef DO_COPY
+#undef DO_ADD
+#undef DO_SUB
+#undef DO_DIV
+#undef DO_MPY
+#undef IS_TREQ
+#undef IS_TRGT
+#undef ENTER
+#undef SINGLE
+#undef BRANCH
+#undef FUSED
+	m.IP = Word(c->fall - code);
+	m.IR = c->word;
+	m.steps = limit - left;
+	m.halted = halted;
+	return halted;
+#else
+	return m.Do(maxSteps);
+#endif
+}
+
+// hardware counters
+enum { pcCYCLES, pcINSTRUCTIONS, pcBRANCHMISSES, pcCACHEMISSES, pcCOUNT };
+static const char* const pcName[pcCOUNT] = { "cycles", "instructions", "branch-misses", "cache-misses" };
+
+// Host-side measurements of one run (or a sum of runs).
+struct PerfStats {
+	unsigned long long steps {0};        // emulated instructions executed
+	unsigned long long runs {0};
+	double seconds {0.0};
+	unsigned long long counter[pcCOUNT] {};
+	unsigned long long counted[pcCOUNT] {}; // runs in which the counter was read
+
+	// the counter was read in every run of the sum
+	bool Has(int i) const { return runs > 0 && counted[i] == runs; }
+	void Add(const PerfStats& st);
+	void Print(std::ostream& os) const;
+};
+
+// Wrapper around perf_event_open. The counters are opened as one group,
+// so they are scheduled together and their ratios stay consistent;
+// if the kernel multiplexes the group, values are scaled by
+// time_enabled / time_running over the run (the kernel never resets
+// the times, so they are read at Start and subtracted). Counters that can't be opened
+// (no permission, container, event missing on this CPU, non-Linux host)
+// are reported as unavailable one by one, wall-clock time and step
+// counts are always available.
+class PerfCounters {
+	public:
+		PerfCounters();
+		~PerfCounters();
+		void Start();
+		void Stop(PerfStats& st);
+		bool Available();
+	private:
+		int fd[pcCOUNT];
+		int slot[pcCOUNT];      // position of the counter in a group read, -1 - not opened
+		int leader;             // fd of the group leader, -1 - no counters
+		int members;
+		bool opened;
+		uint64_t base[3 + pcCOUNT]; // чтение группы в Start, base[0] == 0 - не прочитано
+		std::chrono::steady_clock::time_point t0;
+		void Open();
+};
+
+template <class G>
+class TINYAC : public Machine<G> {
 	public:
-		bool OV; //overflow state 		OV/NO
-		bool D0; //division by zero		D0/ND
-		Word IR; //instruction register
-		Word IP; //instruction pointer
-		Word memory[MEMSIZE];
+		typedef typename G::Word Word;
+		static constexpr int MEMSIZE  = G::MEMSIZE;
+		static constexpr int LASTADDR = G::LASTADDR;
+		using Machine<G>::OV;
+		using Machine<G>::D0;
+		using Machine<G>::IR;
+		using Machine<G>::IP;
+		using Machine<G>::memory;
+		using Machine<G>::PR;
+		using Machine<G>::steps;
+		
 		Word OP1;
 		
 		std::string dir;
 		std::vector<std::string> parsedDir; //разобранная команда
 		std::string fileName;
 		
-		TINYAC();
+		bool perfOn {false};  //сбор счётчиков при G
+		PerfCounters perf;
+		PerfStats lastRun;
+		bool lastMeasured {false}; //lastRun снят при включённом сборе
+		std::ostream* output {&std::cout}; //куда печатает PRST
+		
+		TINYAC(bool banner = true);
 		void DumpMem();
 		void LoadTest();
-		void Do();
+		bool Do(unsigned long long maxSteps = 0);
 		int  Step();
 		void Console();
 		void ParseDir();
@@ -98,126 +666,96 @@ class TINYAC {
 		void WriteFile();
 		void FillMem();
 		void MoveMem();
+		void Fill(Word value, int from, int to);
+		int  Move(int from, int to, int target);
 		void EditRegs();
 		void ViewRegs();
 		void EditMem();
 		void Compute();
+		bool ParseWord(const std::string& token, Word& word);
 		void Trace();
+		void ShowPerf();
 };
 
-int main(int argc, char** argv) {
-	TINYAC tinyac;
+int RunShard(int argc, char** argv);
+int MergeResults(int argc, char** argv);
+int RunScripts(int argc, char** argv);
+int Serve(int argc, char** argv);
+
+template <class G>
+int RunConsole() {
+	TINYAC<G> tinyac;
 	tinyac.Console();
 	return 0;
 }
 
-TINYAC::TINYAC() {
+int main(int argc, char** argv) {
+	int words {8};
+	if (argc == 3 && std::string(argv[1]) == "-m") words = std::atoi(argv[2]);
+	else if (argc > 1) {
+		std::string mode = argv[1];
+		if (mode == "shard") return RunShard(argc, argv);
+		if (mode == "merge") return MergeResults(argc, argv);
+		if (mode == "script") return RunScripts(argc, argv);
+		if (mode == "serve") return Serve(argc, argv);
+		std::cerr << "Usage: tinyac [-m <words>]" << std::endl
+		          << "       tinyac shard [-p] <manifest> <shard> <result>" << std::endl
+		          << "       tinyac merge <report> <result> [<result>...]" << std::endl
+		          << "       tinyac script [-m <words>] <file> [<file>...]" << std::endl
+		          << "       tinyac serve <socket> [<workers>]" << std::endl;
+		return 2;
+	}
+	switch (words) {
+		case Classic::MEMSIZE:    return RunConsole<Classic>();
+		case Extended::MEMSIZE:   return RunConsole<Extended>();
+		case Extended4K::MEMSIZE: return RunConsole<Extended4K>();
+	}
+	std::cerr << "Memory size must be 8, 256 or 4096 words" << std::endl;
+	return 2;
+}
+
+template <class G>
+TINYAC<G>::TINYAC(bool banner) {
 	for(int i = 0; i < MEMSIZE; i++) {
 		memory[i] = 0;
+		if (!banner || (i + 1) % (MEMSIZE / 8) != 0) continue;
+#ifdef _WIN32
 		system("color 0A");
 		system("cls");
+#endif
 		std::cout <<"Training Automatic Computing Machine \"TINYAC\" Build I"<<std::endl;
 		std::cout <<"It's more fun to compute..."<<std::endl;
 		std::cout <<""<<std::endl;
 		std::cout << i+1 << "W Ok";
 		Sleep(50);
-		fileName = "program.bin";
 	}
+	fileName = "program.bin";
 	OV = false;
 	D0 = false;	
 	IR = 0;
 	IP = 0;
 }
 
-int TINYAC::Step() {
-	std::vector<int8_t> parsedWord;
-	_WORD wd;
-	
-	IR = memory[IP];
-	IP++; if(IP > LASTADDR) IP = 0; // достигли конца памяти, переходим на 0
-	wd.word = IR;
-	parsedWord.clear();
-    parsedWord.push_back(wd.byte0); 
-	parsedWord.push_back(wd.byte1); 
-	parsedWord.push_back(wd.byte2); 
-	parsedWord.push_back(wd.byte3);
-	switch (wd.byte0) {
-		case cmCOPY:
-			memory[wd.byte3] = memory[wd.byte1];
-			break;
-		case cmADD: 
-			if (((memory[wd.byte2] > 0) && (memory[wd.byte1] > (SHRT_MAX - memory[wd.byte2]))) || ((memory[wd.byte2] < 0) && (memory[wd.byte1] < (SHRT_MIN - memory[wd.byte2])))) {
-    			OV = true;
-  			} 
-			else memory[wd.byte3] = memory[wd.byte1] + memory[wd.byte2];
-			break;
-		case cmDIV:
-			if (memory[wd.byte2]==0) D0 = true;
-			else if ((memory[wd.byte2] == 0) || ((memory[wd.byte1] == SHRT_MIN) && (memory[wd.byte2] == -1))) {
-    			OV = true;
-  			} 
-			else memory[wd.byte3] = memory[wd.byte1] / memory[wd.byte2];
-			break;
-		case cmSUB:
-			if ((memory[wd.byte2] > 0 && memory[wd.byte1] < SHRT_MIN + memory[wd.byte2]) || (memory[wd.byte2] < 0 && memory[wd.byte1] > SHRT_MAX + memory[wd.byte2])) {
-				OV = true;
-			} 
-			else memory[wd.byte3] = memory[wd.byte1] - memory[wd.byte2];
-			break;
-		case cmTREQ: 
-			if (memory[wd.byte1] == memory[wd.byte2]) IP = wd.byte3;
-			break;
-		case cmMPY:
-			if (memory[wd.byte1] > 0) {  /* 1 is positive */
-    			if (memory[wd.byte2] > 0) {  /* 1 and 2 are positive */
-      				if (memory[wd.byte1] > (SHRT_MAX / memory[wd.byte2])) {
-        				OV = true;
-      				}
-    			} 
-				else { /* 1 positive, 2 nonpositive */
-      				if (memory[wd.byte2] < (SHRT_MIN / memory[wd.byte1])) {
-        				OV = true;
-      				}
-    			} /* 1 positive, 2 nonpositive */
-  			} 
-			else { /* 1 is nonpositive */
-    			if (memory[wd.byte2] > 0) { /* 1 is nonpositive, 2 is positive */
-      				if (memory[wd.byte1] < (SHRT_MIN / memory[wd.byte2])) {
-        				OV = true;
-      				}
-    			} 
-				else { /* 1 and 2 are nonpositive */
-      				if ( (memory[wd.byte1] != 0) && (memory[wd.byte2] < (SHRT_MAX / memory[wd.byte1]))) {
-        				OV = true;
-      				}
-    			} /* End if 1 and 2 are nonpositive */
-  			} /* End if 1 is nonpositive */
-
-  			memory[wd.byte3] = memory[wd.byte1] * memory[wd.byte2];
-			break;
-		case cmTRGT:
-			if (memory[wd.byte1] > memory[wd.byte2]) IP = wd.byte3;
-			break;
-		case cmPRST: 
-			std::cout << memory[wd.byte1] << " " << memory[wd.byte2] << " " << memory[wd.byte3] << std::endl;
-			break;
-		default:
-			return cmPRST; //неизвестная инструкция - STOP!
-			break;
-	}
-	return wd.byte0;
+template <class G>
+int TINYAC<G>::Step() {
+	int code = Machine<G>::Step();
+	if (code == cmPRST) *output << PR[0] << " " << PR[1] << " " << PR[2] << std::endl;
+	if (code == cmHALT) return cmPRST;
+	return code;
 }
 
-void TINYAC::DumpMem() {
+template <class G>
+void TINYAC<G>::DumpMem() {
 	std::cout << "Dumping..." << std::endl;
 	for(int i = 0; i < MEMSIZE; i++) {
 		std::cout << std::setw(2) << std::setfill('0') << i << ":" << std::setw(6) << std::setfill('0') << std::hex << memory[i]<<':'
 		          << std::setw(6) << std::setfill(' ') << std::dec << memory[i] << "D\t";
-		if (i==3) std::cout <<std::endl;
+		if (i % 4 == 3 && i != LASTADDR) std::cout <<std::endl;
 	}
 }
 
-void TINYAC::LoadTest() {
+template <class G>
+void TINYAC<G>::LoadTest() {
 	//00 0001 0110 0111 0101 0x1675 ; ADD  6 7 5 ;P=A+B
 	//01 0001 0101 0101 0101 0x1555 ; ADD  5 5 5 ;P=P+P
 	//02 0111 0110 0111 0101 0x7675 ; PRST 6 7 5 ;print A B P
@@ -226,26 +764,32 @@ void TINYAC::LoadTest() {
 	//05 0000 0000 0000 0000 0x0000 ; P
 	//06 0000 0000 0000 0002 0x0002 ; A
 	//07 0000 0000 0000 0001 0x0001 ; B
-	memory[0] = 0x1675;
-	memory[1] = 0x1555;
-	memory[2] = 0x7675;
-	memory[3] = 0x0000;
-	memory[4] = 0x0000;
-	memory[5] = 0x0000;
-	memory[6] = 0x0002;
-	memory[7] = 0x0001;
+	constexpr Image<G> test = AssembleText<G>(TEST_PROGRAM);
+	for (int i = 0; i < MEMSIZE; i++) memory[i] = test.memory[i];
 }
 
-void TINYAC::Do() {
-	for(;;) if (Step()==cmPRST) break;
+// maxSteps = 0 - без ограничения; false, если PRST не достигнут
+template <class G>
+bool TINYAC<G>::Do(unsigned long long maxSteps) {
+	if (perfOn) perf.Start();
+	bool halted = RunThreaded<G>(*this, maxSteps);
+	lastRun = PerfStats();
+	lastMeasured = perfOn;
+	if (perfOn) perf.Stop(lastRun);
+	if (halted && G::OpCode(IR) == cmPRST) *output << PR[0] << " " << PR[1] << " " << PR[2] << std::endl;
+	lastRun.steps = steps;
+	lastRun.runs = 1;
+	return halted;
 }
 
-void TINYAC::Trace() {
+template <class G>
+void TINYAC<G>::Trace() {
 	Step();
 	ViewRegs();
 }
 
-void TINYAC::Console() {
+template <class G>
+void TINYAC<G>::Console() {
 	for (;;) {
 		std::cout <<"\n-";
 		dir="";
@@ -260,6 +804,7 @@ void TINYAC::Console() {
 			case 'g':
 			case 'G':
 				Do();
+				if (perfOn) lastRun.Print(std::cout);
 				break;
 			case 'd':
 			case 'D':
@@ -313,6 +858,10 @@ void TINYAC::Console() {
 			case 'T':
 				Trace();
 				break;
+			case 'p':
+			case 'P':
+				ShowPerf();
+				break;
 			case '!':
 				LoadTest();//++
 				break;
@@ -322,7 +871,8 @@ void TINYAC::Console() {
 	}
 }
 
-void TINYAC::ParseDir() {
+template <class G>
+void TINYAC<G>::ParseDir() {
 	if (dir != "") {
 		parsedDir.clear();
 		std::stringstream cstream;
@@ -334,51 +884,28 @@ void TINYAC::ParseDir() {
 	}
 }
 
-void TINYAC::Assemble() {
-	int org;
+template <class G>
+void TINYAC<G>::Assemble() {
+	int org {0};
 	Word word;
-	std::vector<std::string> parsedInstr;
 	std::string instr;
 
-	if (parsedDir.size() == 1) //без параметров
-		org = 0;
 	if (parsedDir.size() > 1) {
-		org = std::stoi(parsedDir[1]);
+		long long v {0};
+		org = (ParseNumber(parsedDir[1], 10, v) && v >= 0 && v <= LASTADDR) ? int(v) : -1;
 	}
 	if ((org >=0) & (org <= LASTADDR)) {
 		std::cout <<"Assembling...\n";
 		do {
 			std:: cout << "" << std::setw(2) << std::setfill('0') << org <<":";
 			instr.clear();
-			parsedInstr.clear();
 			word = 0;
 			std::getline(std::cin,instr);
 			if (instr != "") { //assembling
-				std::stringstream cs;
-				std::string token;
-				cs << instr;
-				while (cs >> token) parsedInstr.push_back(token);
-				if (parsedInstr.size() == 4) word = ((std::stoi(parsedInstr[1])) << 8) + ((std::stoi(parsedInstr[2])) << 4) + (std::stoi(parsedInstr[3]));
-				for (int i = 0; i < parsedInstr[0].size(); i++) parsedInstr[0][i] = toupper(parsedInstr[0][i]);
-				if      ((parsedInstr[0]=="COPY") && (parsedInstr.size() == 4)) word += 0x0000;
-				else if ((parsedInstr[0]=="ADD")  && (parsedInstr.size() == 4)) word += 0x1000;
-				else if ((parsedInstr[0]=="DIV")  && (parsedInstr.size() == 4)) word += 0x2000;
-				else if ((parsedInstr[0]=="SUB")  && (parsedInstr.size() == 4)) word += 0x3000;
-				else if ((parsedInstr[0]=="TREQ") && (parsedInstr.size() == 4)) word += 0x4000;
-				else if ((parsedInstr[0]=="MPY")  && (parsedInstr.size() == 4)) word += 0x5000;
-				else if ((parsedInstr[0]=="TRGT") && (parsedInstr.size() == 4)) word += 0x6000;
-				else if ((parsedInstr[0]=="PRST") && (parsedInstr.size() == 4)) word += 0x7000;
-				else if ((parsedInstr[0]=="DEFD") && (parsedInstr.size() == 2)) word = std::stoi(parsedInstr[1]);
-				else if ((parsedInstr[0]=="DEFH") && (parsedInstr.size() == 2)) {
-					int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedInstr[1];
-					ss >> b;
-					word = b;
-				} else {
+				if (!AssembleLine<G>(instr, word)) {
 					std::cout << "Illegal instruction\n";
 					continue;
-				};
+				}
 				memory[org] = word;
 				org++;
 				if (org>LASTADDR) org = 0; //заворачиваем адреса
@@ -387,48 +914,33 @@ void TINYAC::Assemble() {
 	} else std::cout << "Illegal address";
 }
 
-void TINYAC::Unassemble() {
+template <class G>
+void TINYAC<G>::Unassemble() {
 	std::vector<std::string> programText;
 	std::string programString;
 	std::string buffer;
-	std::array<bool,MEMSIZE> isData {false, false, false, false, false, false, false, false}; //таблица данных
+	std::array<bool,MEMSIZE> isData {}; //таблица данных
 	bool isPRST {false}; //достигнут ли конец программы - инструкция PRST всегда последняя
 	int lastPRSTaddr {0};
 	Word word {0};
-	_WORD wd;
-	std::vector<int8_t> parsedWord;
+	int parsedWord[4]; //код и три адреса
 	
 	programText.clear();
-	parsedWord.clear();	//3-2-1-0
 	buffer = "";
 	isPRST = false;
     // --0 pass
     // ищем конец программы
     for (auto adr0 = 0; adr0 < MEMSIZE; adr0++) {
-    	word = memory[adr0]; 
-    	wd.word = word;
-    	parsedWord.clear();
-    	parsedWord.push_back(wd.byte0); 
-		parsedWord.push_back(wd.byte1); 
-		parsedWord.push_back(wd.byte2); 
-		parsedWord.push_back(wd.byte3);
-		if (parsedWord[0] == cmPRST) lastPRSTaddr = adr0;	 
+		if (G::OpCode(memory[adr0]) == cmPRST) lastPRSTaddr = adr0;
 	}
 	// --1 pass
     for(auto adr = 0; adr < MEMSIZE; adr++) {
 	// parse word
-		//_WORD wd;
-		word = memory[adr]; //std::cout <<"Adr=" <<adr << " "<< "word="<<word << " ";
-		wd.word = word;
-		parsedWord.clear();
-		parsedWord.push_back(wd.byte0); //std::cout <<"byte0=" << wd.byte0+30 << " ";
-		parsedWord.push_back(wd.byte1); //std::cout <<"byte1=" << wd.byte1+30 << " ";
-		parsedWord.push_back(wd.byte2); //std::cout <<"byte2=" << wd.byte2+30 << " ";
-		parsedWord.push_back(wd.byte3); //std::cout <<"byte3=" << wd.byte3+30 << " ";
-		for(auto idx=0; idx<4; idx++) {
-			parsedWord[idx] = parsedWord[idx] & 0x00F; // обнулить старшую тетраду
-			//parsedWord[idx] = parsedWord[idx] | 0x0F0; // установить в 1 старшую тетраду
-		}
+		word = memory[adr];
+		parsedWord[0] = G::OpCode(word);
+		parsedWord[1] = G::Addr1(word);
+		parsedWord[2] = G::Addr2(word);
+		parsedWord[3] = G::Addr3(word);
     // end parse word
 	// parse for instructions/data
 		if (isPRST==false) {
@@ -454,10 +966,6 @@ void TINYAC::Unassemble() {
 			}
 		} else isData.at(adr) = true;
 	// end parse for instructions/data
-	// !debug 
-	//for(auto i =0; i <8;i++ ) std:: cout << isData[i] << " ";
-	//std::cout << std::endl;
-	// !end debug
 	}
     // --2 pass
     // decoding
@@ -470,17 +978,8 @@ void TINYAC::Unassemble() {
 		ss >> buffer; ss.clear();
 		programString = programString + buffer+"    ";
 	// parse word
-		//_WORD wd;
-		word = memory[adr2];
-		wd.word = word;
-		parsedWord.clear();
-		parsedWord.push_back(wd.byte0);
-		parsedWord.push_back(wd.byte1);
-		parsedWord.push_back(wd.byte2);
-		parsedWord.push_back(wd.byte3);
-		for(auto idx=0; idx<4; idx++) parsedWord[idx] = parsedWord[adr2] & 0x00F; // обнулить старшую тетраду
 		if(isData.at(adr2)==false) { //если инструкция
-			switch (wd.byte0) {
+			switch (G::OpCode(word)) {
 				case cmCOPY: buffer = "COPY "; break; 
 				case cmADD:  buffer = "ADD ";  break; 
 				case cmDIV:  buffer = "DIV ";  break; 
@@ -492,15 +991,15 @@ void TINYAC::Unassemble() {
 			}
 			programString = programString + buffer;
 			buffer = "";
-			ss << std::setw(2) << std::setfill('0') << std::hex << wd.byte1+0;
+			ss << std::setw(2) << std::setfill('0') << std::hex << G::Addr1(word);
 			ss >> buffer; ss.clear();
 			programString = programString + buffer+' ';
 			buffer = "";
-			ss << std::setw(2) << std::setfill('0') << std::hex << wd.byte2+0;
+			ss << std::setw(2) << std::setfill('0') << std::hex << G::Addr2(word);
 			ss >> buffer; ss.clear();
 			programString = programString + buffer+ ' ';
 			buffer = "";
-			ss << std::setw(2) << std::setfill('0') << std::hex << wd.byte3+0;
+			ss << std::setw(2) << std::setfill('0') << std::hex << G::Addr3(word);
 			ss >> buffer;ss.clear();
 			programString = programString + buffer;
 			buffer = "";
@@ -521,7 +1020,8 @@ void TINYAC::Unassemble() {
 	for(auto i = 0; i < MEMSIZE; i++) std::cout<< programText.at(i)<<std::endl;
 }
 
-void TINYAC::SetName() {
+template <class G>
+void TINYAC<G>::SetName() {
 	std::string tmp;
 	std::cout << "Old Name: "<< std::endl << fileName << " " << std::endl;
 	std::cout << "New Name: ";
@@ -534,7 +1034,8 @@ void TINYAC::SetName() {
 	std::cout << fileName;
 }
 
-void TINYAC::LoadFile() {
+template <class G>
+void TINYAC<G>::LoadFile() {
 	FILE* fptr;
 	if ((fptr = fopen(fileName.c_str(), "rb")) == NULL) {
 		std::cout << "File open error";
@@ -545,10 +1046,11 @@ void TINYAC::LoadFile() {
 		else std::cout << "File read error";
 	};
 	fclose(fptr);
-	std::cout<< "8 words read";
+	std::cout<< MEMSIZE << " words read";
 }
 
-void TINYAC::WriteFile() {
+template <class G>
+void TINYAC<G>::WriteFile() {
 	FILE* fptr;
 	if ((fptr = fopen(fileName.c_str(), "wb")) == NULL) {
 		std::cout << "File open error";
@@ -560,164 +1062,73 @@ void TINYAC::WriteFile() {
 	};
 	
 	fclose(fptr);
-	std::cout<< "8 words written";
+	std::cout<< MEMSIZE << " words written";
 }
 
-void TINYAC::FillMem() {
+template <class G>
+void TINYAC<G>::FillMem() {
 	Word fillValue {0};
-	int fillFrom {0};
-	int fillTo {0};
-	if(parsedDir.size()>1) {
-		if(parsedDir.size() == 2) {
-			if(parsedDir[1][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[1];
-					ss >> b;
-					fillValue = b;
-			}
-			else fillValue = std::stoi(parsedDir[1]);
-			fillFrom = 0;
-			fillTo = LASTADDR;		 
-		}
-		else if(parsedDir.size() == 3) {
-			if(parsedDir[1][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[1];
-					ss >> b;
-					fillValue = b;
-			}
-			else fillValue = std::stoi(parsedDir[1]);
-			if(parsedDir[2][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[2];
-					ss >> b;
-					fillFrom = b;
-			}
-			else fillFrom = std::stoi(parsedDir[2]);
-			if (fillFrom < 0) fillFrom = 0;
-			if (fillFrom > LASTADDR) fillFrom = LASTADDR;
-			fillTo = LASTADDR;		 
-		}
-		else if(parsedDir.size() >= 4) {
-			if(parsedDir[1][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[1];
-					ss >> b;
-					fillValue = b;
-			}
-			else fillValue = std::stoi(parsedDir[1]);
-			if(parsedDir[2][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[2];
-					ss >> b;
-					fillFrom = b;
-			}
-			else fillFrom = std::stoi(parsedDir[2]);
-			if (fillFrom < 0) fillFrom = 0;
-			if (fillFrom > LASTADDR) fillFrom = LASTADDR;
-			if(parsedDir[3][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[3];
-					ss >> b;
-					fillTo = b;
-			}
-			else fillTo = std::stoi(parsedDir[3]);
-			if (fillTo < 0) fillTo = 0;
-			if (fillTo > LASTADDR) fillTo = LASTADDR;
-			if (fillTo < fillFrom) {
-				int b;
-				b = fillTo;
-				fillTo = fillFrom;
-				fillFrom = b;
-			}		 
-		}
-		for(auto i = fillFrom; i <= fillTo; i++) memory[i] = fillValue;
-		std::cout << fillTo - fillFrom + 1 << " words(s) written";  
-	} 
-}
-
-void TINYAC::MoveMem() {
-	int srcFrom;
-	int srcTo;
-	int trgFrom;
-	if(parsedDir.size() >= 4) {
-			if(parsedDir[1][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[1];
-					ss >> b;
-					srcFrom = b;
-			}
-			else srcFrom = std::stoi(parsedDir[1]);
-			if (srcFrom < 0) srcFrom = 0;
-			if (srcFrom > LASTADDR) srcFrom = LASTADDR;			
-			if(parsedDir[2][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[2];
-					ss >> b;
-					srcTo = b;
-			}
-			else srcTo = std::stoi(parsedDir[2]);
-			if (srcTo < 0) srcFrom = 0;
-			if (srcTo > LASTADDR) srcTo = LASTADDR;
-			if(parsedDir[3][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[3];
-					ss >> b;
-					trgFrom = b;
-			}
-			else trgFrom = std::stoi(parsedDir[3]);
-			if (trgFrom < 0) trgFrom = 0;
-			if (srcTo < srcFrom) {
-				int b;
-				b = srcTo;
-				srcTo = srcFrom;
-				srcFrom = b;
-			}		 
-		for (auto i = srcFrom; i <= srcTo; i++) memory[i+trgFrom-srcFrom] = memory[i];
-		std::cout << srcTo - srcFrom + 1 << " words(s) moved";
+	long long fillFrom {0};
+	long long fillTo {LASTADDR};
+	if (parsedDir.size() < 2) return;
+	if (!ParseWord(parsedDir[1], fillValue)
+	    || (parsedDir.size() > 2 && !InputNumber(parsedDir[2], fillFrom))
+	    || (parsedDir.size() > 3 && !InputNumber(parsedDir[3], fillTo))) {
+		std::cout << "Illegal value";
+		return;
+	}
+	fillFrom = std::clamp(fillFrom, 0LL, (long long)LASTADDR);
+	fillTo = std::clamp(fillTo, 0LL, (long long)LASTADDR);
+	if (fillTo < fillFrom) std::swap(fillFrom, fillTo);
+	Fill(fillValue, int(fillFrom), int(fillTo));
+	std::cout << fillTo - fillFrom + 1 << " words(s) written";
+}
+
+template <class G>
+void TINYAC<G>::MoveMem() {
+	long long v[3];
+	if (parsedDir.size() < 4) return;
+	for (int i = 0; i < 3; i++)
+		if (!InputNumber(parsedDir[i + 1], v[i])) {
+			std::cout << "Illegal value";
+			return;
 		}
+	int srcFrom = int(std::clamp(v[0], 0LL, (long long)LASTADDR));
+	int srcTo   = int(std::clamp(v[1], 0LL, (long long)LASTADDR));
+	int trgFrom = int(std::clamp(v[2], 0LL, (long long)MEMSIZE)); //за концом памяти ничего не переносится
+	if (srcTo < srcFrom) std::swap(srcFrom, srcTo);
+	std::cout << Move(srcFrom, srcTo, trgFrom) << " words(s) moved";
 }
 
-void TINYAC::EditRegs() {
+template <class G>
+void TINYAC<G>::Fill(Word value, int from, int to) {
+	for(auto i = from; i <= to; i++) memory[i] = value;
+}
+
+// returns number of words moved, the part beyond memory end is dropped
+template <class G>
+int TINYAC<G>::Move(int from, int to, int target) {
+	int n {0};
+	for (auto i = from; i <= to && i + target - from <= LASTADDR; i++, n++) memory[i+target-from] = memory[i];
+	return n;
+}
+
+template <class G>
+void TINYAC<G>::EditRegs() {
 	std::string w;
 	std::cout << "IR:" << std::setw(6) << std::setfill('0') << std::hex << IR <<':'
 		      << std::setw(6) << std::setfill(' ') << std::dec << IR << "D:";
 	std::getline(std::cin,w);
-	if (w !="") {
-		if(w[0]=='0') { //hex
-			int b {0};
-			std::stringstream ss;
-			ss << std::hex << w;
-			ss >> b;
-			IR = b;
-		}
-	else IR = std::stoi(w);
-	}
+	if (w !="" && !ParseWord(w, IR)) std::cout << "Illegal value" << std::endl;
 	std::cout << "IR set to " << std::setw(6) << std::setfill('0') << std::hex << IR<<std::endl;
 	std::cout << "IP:" << std::setw(6) << std::setfill('0') << std::hex << IP <<':'
 		      << std::setw(6) << std::setfill(' ') << std::dec << IP << "D:";
 	std::getline(std::cin,w);
 	if (w !="") {
-		if(w[0]=='0') { //hex
-			int b {0};
-			std::stringstream ss;
-			ss << std::hex << w;
-			ss >> b;
-			IP = b;
-		}
-	else IP = std::stoi(w);
+		long long v {0};
+		if (!InputNumber(w, v)) std::cout << "Illegal value" << std::endl;
+		else IP = Word(std::clamp(v, 0LL, (long long)LASTADDR));
 	}
-	if (IP > 7) IP = 7;
-	if (IP < 0) IP = 0;
 	std::cout << "IP set to " << std::setw(6) << std::setfill('0') << std::hex << IP<<std::endl;
 	
 	if (OV == true) std::cout << "OV"; else std::cout <<"NO";
@@ -728,7 +1139,8 @@ void TINYAC::EditRegs() {
 	if (w !="") if (w=="1") D0 = true; else D0 = false;
 }
 
-void TINYAC::ViewRegs() {
+template <class G>
+void TINYAC<G>::ViewRegs() {
 	std::cout << "IR:" << std::setw(6) << std::setfill('0') << std::hex << IR <<':'
 		      << std::setw(6) << std::setfill(' ') << std::dec << IR << "D\n";
 	std::cout << "IP:" << std::setw(6) << std::setfill('0') << std::hex << IP <<':'
@@ -737,21 +1149,15 @@ void TINYAC::ViewRegs() {
 	if (D0 == true) std::cout << " D0"; else std::cout << " ND";
 }
 
-void TINYAC::EditMem() {
+template <class G>
+void TINYAC<G>::EditMem() {
 	int org {0};
 	std::string instr;
 	Word word {0};
 	if (parsedDir.size() == 2) {
-		if(parsedDir[1][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[1];
-					ss >> b;
-					org = b;
-			}
-			else org = std::stoi(parsedDir[1]);
-	} 
-	else if(parsedDir.size() == 1) 	org = 0;
+		long long v {0};
+		org = (InputNumber(parsedDir[1], v) && v >= 0 && v <= LASTADDR) ? int(v) : -1;
+	}
 	if ((org >=0) & (org <= LASTADDR)) {
 		do {
 			std:: cout << "" << std::setw(2) << std::setfill('0') << org <<":";
@@ -759,46 +1165,1134 @@ void TINYAC::EditMem() {
 			word = 0;
 			std::getline(std::cin,instr);
 			if (instr !="") {
-				if(instr[0]=='0') { //hex
-					int b {0};
-					std::stringstream ss;
-					ss << std::hex << instr;
-					ss >> b;
-					word = b;
+				if (!ParseWord(instr, word)) {
+					std::cout << "Illegal value\n";
+					continue;
 				}
-				else word = std::stoi(instr);
 				memory[org] = word;
 				org++;
 				if (org>LASTADDR) org = 0; //заворачиваем адреса
 			}
 		} while (instr !="");
+	} else std::cout << "Illegal address";
+}
+
+template <class G>
+void TINYAC<G>::Compute() {
+	long long first  {0};
+	long long second {0};
+	if (parsedDir.size() < 3) return;
+	if (!InputNumber(parsedDir[1], first) || !InputNumber(parsedDir[2], second)) {
+		std::cout << "Illegal value";
+		return;
+	}
+	// в шестнадцатеричном виде - как машинное слово
+	long long sum  = (long long)((unsigned long long)first + (unsigned long long)second);
+	long long diff = (long long)((unsigned long long)first - (unsigned long long)second);
+	std::cout << "+ "<<std::setw(6) << std::setfill('0') << std::hex << +typename G::UWord(sum) <<':'
+	      << std::setw(6) << std::setfill(' ') << std::dec << sum << "D\n";
+	std::cout << "- "<<std::setw(6) << std::setfill('0') << std::hex << +typename G::UWord(diff) <<':'
+	      << std::setw(6) << std::setfill(' ') << std::dec << diff << "D\n";
+}
+
+// word as signed or unsigned number: -1 and 0FFFF are the same 16-bit word
+template <class G>
+bool TINYAC<G>::ParseWord(const std::string& token, Word& word) {
+	long long v {0};
+	if (!InputNumber(token, v)) return false;
+	if (G::WORDBITS < 64 && (v < G::WMIN || v > (long long)std::numeric_limits<typename G::UWord>::max()))
+		return false;
+	word = Word(v);
+	return true;
+}
+
+template <class G>
+void TINYAC<G>::ShowPerf() {
+	if (parsedDir.size() > 1) {
+		std::string arg = parsedDir[1];
+		for (auto& c : arg) c = toupper(c);
+		if (arg == "ON") perfOn = true;
+		else if (arg == "OFF") perfOn = false;
+		else {
+			std::cout << "ON/OFF?";
+			return;
+		}
+		std::cout << "Counters " << (perfOn ? "on" : "off");
+		if (perfOn && !perf.Available()) std::cout << " (hardware counters unavailable)";
+		return;
+	}
+	if (lastRun.runs == 0) {
+		std::cout << "No run yet";
+		return;
+	}
+	if (!lastMeasured) {
+		std::cout << "Counters were off during the last run";
+		return;
+	}
+	lastRun.Print(std::cout);
+}
+
+void PerfStats::Add(const PerfStats& st) {
+	steps += st.steps;
+	runs += st.runs;
+	seconds += st.seconds;
+	for (int i = 0; i < pcCOUNT; i++) {
+		counter[i] += st.counter[i];
+		counted[i] += st.counted[i];
+	}
+}
+
+void PerfStats::Print(std::ostream& os) const {
+	std::ios::fmtflags flags = os.flags();
+	std::streamsize prec = os.precision();
+	os << std::dec << "runs " << runs << ", steps " << steps << ", "
+	   << std::fixed << std::setprecision(6) << seconds << " s";
+	if (seconds > 0) os << ", " << std::setprecision(2) << steps / seconds / 1e6 << " MIPS";
+	os << std::endl;
+	bool any = false;
+	for (int i = 0; i < pcCOUNT; i++) if (Has(i)) any = true;
+	if (!any) os << "hardware counters unavailable" << std::endl;
+	else {
+		for (int i = 0; i < pcCOUNT; i++) {
+			os << (i ? ", " : "") << pcName[i] << ' ';
+			if (Has(i)) os << counter[i];
+			else os << "n/a";
+		}
+		os << std::endl;
+		if (steps > 0 && (Has(pcCYCLES) || Has(pcINSTRUCTIONS))) {
+			os << std::setprecision(2) << "per step:";
+			if (Has(pcCYCLES)) os << ' ' << double(counter[pcCYCLES]) / steps << " cycles";
+			if (Has(pcCYCLES) && Has(pcINSTRUCTIONS)) os << ',';
+			if (Has(pcINSTRUCTIONS)) os << ' ' << double(counter[pcINSTRUCTIONS]) / steps << " instructions";
+			os << std::endl;
+		}
+	}
+	os.flags(flags);
+	os.precision(prec);
+}
+
+PerfCounters::PerfCounters() : leader(-1), members(0), opened(false) {
+	for (int i = 0; i < pcCOUNT; i++) fd[i] = slot[i] = -1;
+	base[0] = 0;
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+	for (auto f : fd) if (f >= 0) close(f);
+#endif
+}
+
+void PerfCounters::Open() {
+	opened = true;
+#ifdef __linux__
+	static const unsigned long long config[pcCOUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+	};
+	for (int i = 0; i < pcCOUNT; i++) {
+		struct perf_event_attr pe;
+		memset(&pe, 0, sizeof(pe));
+		pe.type = PERF_TYPE_HARDWARE;
+		pe.size = sizeof(pe);
+		pe.config = config[i];
+		pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		pe.disabled = leader < 0;  // члены группы включаются вместе с лидером
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		fd[i] = syscall(__NR_perf_event_open, &pe, 0, -1, leader, 0);
+		if (fd[i] < 0) continue;
+		if (leader < 0) leader = fd[i];
+		slot[i] = members++;
+	}
+#endif
+}
+
+bool PerfCounters::Available() {
+	if (!opened) Open();
+	return leader >= 0;
+}
+
+void PerfCounters::Start() {
+	if (!opened) Open();
+#ifdef __linux__
+	if (leader >= 0) {
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ssize_t size = ssize_t(sizeof(uint64_t)) * (3 + members);
+		if (read(leader, base, size) != size) base[0] = 0;
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+#endif
+	t0 = std::chrono::steady_clock::now();
+}
+
+void PerfCounters::Stop(PerfStats& st) {
+	auto t1 = std::chrono::steady_clock::now();
+	st.seconds = std::chrono::duration<double>(t1 - t0).count();
+	for (int i = 0; i < pcCOUNT; i++) st.counter[i] = st.counted[i] = 0;
+#ifdef __linux__
+	if (leader < 0) return;
+	ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	// nr, time_enabled, time_running, values[nr]
+	uint64_t data[3 + pcCOUNT];
+	ssize_t size = ssize_t(sizeof(uint64_t)) * (3 + members);
+	if (read(leader, data, size) != size || data[0] != uint64_t(members) || base[0] != data[0]) return;
+	// RESET обнуляет только значения, времена копятся с открытия группы
+	uint64_t enabled = data[1] - base[1], running = data[2] - base[2];
+	if (running == 0) return;  // за этот запуск группа ни разу не попала на PMU
+	double scale = double(enabled) / double(running);
+	for (int i = 0; i < pcCOUNT; i++) if (slot[i] >= 0) {
+		st.counter[i] = (unsigned long long)(double(data[3 + slot[i]] - base[3 + slot[i]]) * scale + 0.5);
+		st.counted[i] = 1;
+	}
+#endif
+}
+
+/*
+	Sharded batch execution.
+
+	A manifest lists program images, one path per line. Optional
+	directives: "shards N" (default 1), "steps N" - step limit per
+	program (default 1000000) and "memory N" - machine size, 8, 256 or
+	4096 words (default 8). Lines starting with '#' are comments.
+	Relative paths are taken from the manifest directory.
+
+	Every program goes to shard FNV-1a(path) % N, so each worker
+	computes its share on its own. A worker appends finished programs
+	to <result>.part, on restart it skips those already there. When the
+	shard is done the lines are sorted into <result> and .part is removed.
+
+	Result line, always RF_COUNT fields separated by TAB:
+	path, status, steps, IP, flags, output, seconds and the pcCOUNT
+	hardware counters. status - HALT, LIMIT (step limit reached) or
+	ERROR (image not read). seconds and counters are filled only with -p
+	and only where measured, otherwise the fields are empty.
+*/
+
+enum { rfPATH, rfSTATUS, rfSTEPS, rfIP, rfFLAGS, rfOUTPUT, rfSECONDS, rfCOUNTERS,
+       RF_COUNT = rfCOUNTERS + pcCOUNT };
+
+struct Manifest {
+	int shards {1};
+	int memory {8}; //размер памяти машины в словах
+	unsigned long long steps {1000000};
+	std::string dir;
+	std::vector<std::string> programs;
+};
+
+static unsigned long long HashPath(const std::string& path) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (unsigned char c : path) {
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool ReadManifest(const std::string& name, Manifest& mf) {
+	std::ifstream in(name);
+	if (!in) {
+		std::cerr << name << ": manifest open error" << std::endl;
+		return false;
+	}
+	auto slash = name.find_last_of("/\\");
+	if (slash != std::string::npos) mf.dir = name.substr(0, slash + 1);
+	std::string line;
+	int lineNo {0};
+	while (std::getline(in, line)) {
+		lineNo++;
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.empty() || line[0] == '#') continue;
+		std::stringstream ls(line);
+		std::string key;
+		long long value {0};
+		ls >> key;
+		if (key == "shards" || key == "steps" || key == "memory") {
+			if (!(ls >> value) || value < 1 || (key == "memory" && value != Classic::MEMSIZE
+			    && value != Extended::MEMSIZE && value != Extended4K::MEMSIZE)) {
+				std::cerr << name << ":" << lineNo << ": bad " << key << std::endl;
+				return false;
+			}
+			if (key == "shards") mf.shards = int(value);
+			else if (key == "memory") mf.memory = int(value);
+			else mf.steps = value;
+		}
+		else mf.programs.push_back(line);
+	}
+	return true;
+}
+
+template <class G>
+static std::string RunProgram(TINYAC<G>& m, const Manifest& mf, const std::string& path, PerfStats* st) {
+	std::string file = path;
+	if (!(file[0] == '/' || file[0] == '\\' || (file.size() > 1 && file[1] == ':'))) file = mf.dir + file;
+	std::stringstream line;
+	line << path << '\t';
+	m.Reset();
+	FILE* fptr = fopen(file.c_str(), "rb");
+	if (fptr == NULL || fread(m.memory, sizeof(m.memory[0]), G::MEMSIZE, fptr) != G::MEMSIZE) {
+		if (fptr != NULL) fclose(fptr);
+		line << "ERROR\t0\t0\t--\t";
+		for (int i = rfSECONDS; i < RF_COUNT; i++) line << '\t';
+		return line.str();
+	}
+	fclose(fptr);
+	std::stringstream out;
+	m.output = &out;
+	bool halted = m.Do(mf.steps);
+	m.output = &std::cout;
+	std::string printed = out.str();
+	if (!printed.empty() && printed.back() == '\n') printed.pop_back();
+	line << (halted ? "HALT" : "LIMIT") << '\t' << m.lastRun.steps << '\t' << m.IP << '\t'
+	     << (m.OV ? "OV" : "NO") << (m.D0 ? "D0" : "ND") << '\t' << printed << '\t';
+	if (st != NULL) {
+		st->Add(m.lastRun);
+		line << std::fixed << std::setprecision(9) << m.lastRun.seconds;
+	}
+	for (int i = 0; i < pcCOUNT; i++) {
+		line << '\t';
+		if (st != NULL && m.lastRun.Has(i)) line << m.lastRun.counter[i];
+	}
+	return line.str();
+}
+
+// splits a result line into fields, false if the line is malformed
+static bool ParseResult(const std::string& line, std::vector<std::string>& field) {
+	field.clear();
+	for (size_t pos = 0;;) {
+		size_t tab = line.find('\t', pos);
+		field.push_back(line.substr(pos, tab == std::string::npos ? std::string::npos : tab - pos));
+		if (tab == std::string::npos) break;
+		pos = tab + 1;
+	}
+	if (field.size() != RF_COUNT) return false;
+	const std::string& status = field[rfSTATUS];
+	return status == "HALT" || status == "LIMIT" || status == "ERROR";
+}
+
+// adds host measurements of a result line, lines without them are skipped
+static void AddResult(const std::vector<std::string>& field, PerfStats& st) {
+	if (field[rfSECONDS].empty()) return;
+	PerfStats one;
+	one.runs = 1;
+	one.steps = std::strtoull(field[rfSTEPS].c_str(), NULL, 10);
+	one.seconds = std::strtod(field[rfSECONDS].c_str(), NULL);
+	for (int i = 0; i < pcCOUNT; i++) if (!field[rfCOUNTERS + i].empty()) {
+		one.counter[i] = std::strtoull(field[rfCOUNTERS + i].c_str(), NULL, 10);
+		one.counted[i] = 1;
+	}
+	st.Add(one);
+}
+
+// runs programs of the shard not done yet, returns their number
+template <class G>
+static size_t RunShardPrograms(const Manifest& mf, int shard, std::set<std::string>& done,
+                               std::ofstream& out, bool perfOn, PerfStats& total) {
+	TINYAC<G> m(false);
+	m.perfOn = perfOn;
+	size_t count {0};
+	for (const auto& path : mf.programs) {
+		if (HashPath(path) % mf.shards != unsigned(shard)) continue;
+		if (!done.insert(path).second) continue;
+		out << RunProgram(m, mf, path, perfOn ? &total : NULL) << '\n';
+		out.flush();
+		count++;
+	}
+	return count;
+}
+
+int RunShard(int argc, char** argv) {
+	int arg {2};
+	bool perfOn {false};
+	if (argc > arg && std::string(argv[arg]) == "-p") {
+		perfOn = true;
+		arg++;
+	}
+	if (argc - arg != 3) {
+		std::cerr << "Usage: tinyac shard [-p] <manifest> <shard> <result>" << std::endl;
+		return 2;
+	}
+	Manifest mf;
+	if (!ReadManifest(argv[arg], mf)) return 1;
+	int shard = std::atoi(argv[arg + 1]);
+	std::string result = argv[arg + 2];
+	std::string part = result + ".part";
+	if (shard < 0 || shard >= mf.shards) {
+		std::cerr << "Shard must be 0.." << mf.shards - 1 << std::endl;
+		return 2;
+	}
+	if (std::ifstream(result)) {
+		std::cout << result << " already complete" << std::endl;
+		return 0;
+	}
+
+	// уже выполненные программы прерванного запуска
+	std::set<std::string> done;
+	std::string journal;
+	{
+		std::ifstream in(part, std::ios::binary);
+		std::stringstream buf;
+		buf << in.rdbuf();
+		journal = buf.str();
+	}
+	auto end = journal.rfind('\n');
+	journal.resize(end == std::string::npos ? 0 : end + 1); // отбросить недописанную строку
+	PerfStats total; // включая программы прерванного запуска
+	std::vector<std::string> field;
+	for (size_t pos = 0; pos < journal.size();) {
+		size_t nl = journal.find('\n', pos);
+		std::string line = journal.substr(pos, nl - pos);
+		if (!ParseResult(line, field)) {
+			std::cerr << part << ": bad line: " << line << std::endl;
+			return 1;
+		}
+		done.insert(field[rfPATH]);
+		AddResult(field, total);
+		pos = nl + 1;
+	}
+	std::ofstream out(part, std::ios::binary | std::ios::trunc);
+	out << journal;
+	if (!out) {
+		std::cerr << part << ": write error" << std::endl;
+		return 1;
+	}
+
+	size_t resumed = done.size();
+	size_t count {0};
+	switch (mf.memory) {
+		case Classic::MEMSIZE:    count = RunShardPrograms<Classic>(mf, shard, done, out, perfOn, total); break;
+		case Extended::MEMSIZE:   count = RunShardPrograms<Extended>(mf, shard, done, out, perfOn, total); break;
+		case Extended4K::MEMSIZE: count = RunShardPrograms<Extended4K>(mf, shard, done, out, perfOn, total); break;
+	}
+	out.close();
+	if (!out) {
+		std::cerr << part << ": write error" << std::endl;
+		return 1;
+	}
+
+	std::vector<std::string> lines;
+	{
+		std::ifstream in(part, std::ios::binary);
+		std::string line;
+		while (std::getline(in, line)) lines.push_back(line);
+	}
+	std::sort(lines.begin(), lines.end());
+	std::string tmp = result + ".tmp";
+	{
+		std::ofstream res(tmp, std::ios::binary | std::ios::trunc);
+		for (const auto& line : lines) res << line << '\n';
+		if (!res) {
+			std::cerr << tmp << ": write error" << std::endl;
+			return 1;
+		}
+	}
+	std::remove(result.c_str());
+	if (std::rename(tmp.c_str(), result.c_str()) != 0) {
+		std::cerr << result << ": rename error" << std::endl;
+		return 1;
+	}
+	std::remove(part.c_str());
+	std::cout << "shard " << shard << "/" << mf.shards << ": " << count << " run, "
+	          << resumed << " resumed, " << lines.size() << " total" << std::endl;
+	if (perfOn) total.Print(std::cout);
+	return 0;
+}
+
+// k-way merge of sorted shard results, one line per file in memory
+int MergeResults(int argc, char** argv) {
+	if (argc < 4) {
+		std::cerr << "Usage: tinyac merge <report> <result> [<result>...]" << std::endl;
+		return 2;
+	}
+	std::vector<std::ifstream> inputs;
+	for (int i = 3; i < argc; i++) {
+		inputs.emplace_back(argv[i], std::ios::binary);
+		if (!inputs.back()) {
+			std::cerr << argv[i] << ": open error" << std::endl;
+			return 1;
+		}
+	}
+	std::ofstream report(argv[2], std::ios::binary | std::ios::trunc);
+	if (!report) {
+		std::cerr << argv[2] << ": open error" << std::endl;
+		return 1;
+	}
+	typedef std::pair<std::string, size_t> Head;
+	std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+	std::string line;
+	for (size_t i = 0; i < inputs.size(); i++)
+		if (std::getline(inputs[i], line)) heads.push(Head(line, i));
+
+	unsigned long long total {0}, halted {0}, limit {0}, errors {0}, steps {0};
+	PerfStats measured; // строки с замерами (-p)
+	std::vector<std::string> field;
+	std::string last;
+	while (!heads.empty()) {
+		Head head = heads.top();
+		heads.pop();
+		if (head.first < last) {
+			std::cerr << argv[head.second + 3] << ": not sorted" << std::endl;
+			return 1;
+		}
+		if (!ParseResult(head.first, field)) {
+			std::cerr << argv[head.second + 3] << ": bad line: " << head.first << std::endl;
+			return 1;
+		}
+		const std::string& status = field[rfSTATUS];
+		if (status == "HALT") halted++;
+		else if (status == "LIMIT") limit++;
+		else errors++;
+		total++;
+		steps += std::strtoull(field[rfSTEPS].c_str(), NULL, 10);
+		AddResult(field, measured);
+		report << head.first << '\n';
+		last.swap(head.first);
+		if (std::getline(inputs[head.second], line)) heads.push(Head(line, head.second));
+	}
+	report << "# " << total << " programs, " << halted << " halted, "
+	       << limit << " step limit, " << errors << " errors, " << steps << " steps";
+	if (measured.runs > 0) {
+		report << "; measured " << measured.runs << ", " << std::fixed << std::setprecision(9)
+		       << measured.seconds << " s";
+		for (int i = 0; i < pcCOUNT; i++) {
+			report << ", " << pcName[i] << ' ';
+			if (measured.Has(i)) report << measured.counter[i];
+			else report << "n/a";
+		}
+	}
+	report << '\n';
+	if (!report) {
+		std::cerr << argv[2] << ": write error" << std::endl;
+		return 1;
+	}
+	std::cout << total << " programs merged" << std::endl;
+	return 0;
+}
+
+/*
+	Script mode: console commands from files, without prompts.
+	Every file is a separate session on a clean machine. The whole file
+	is read at once and parsed in place, arguments follow the command
+	on the same line:
+
+	A [p1], S [p1]     - following lines up to an empty one are
+	                     instructions / values, as typed in the console
+	X reg value        - reg is IR, IP, OV or D0
+	L [file], W [file] - file name is taken as is, N adds .bin
+	G [steps]          - step limit, 1 or more, 1000000 by default
+	? what value...    - assertion: IR, IP, OV, D0, Mn (memory cell n),
+	                     STEPS, OUT a b c (last PRST output)
+	P [ON|OFF]         - as in the console, counters are off at start
+	D, U, R, T, F, M, H, !, Q - as in the console
+
+	-m N before the files selects the machine size as in the console.
+
+	Lines starting with ';' or '#' are comments. Exit code: 0 - all
+	assertions passed, 1 - some failed, 2 - script error.
+*/
+
+#define SCRIPT_STEPS 1000000
+
+enum { scOK, scFAILED, scERROR };
+
+static std::string_view NextLine(std::string_view& text) {
+	size_t nl = text.find('\n');
+	std::string_view line = text.substr(0, nl);
+	text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+	return line;
+}
+
+template <class G>
+static int RunScript(TINYAC<G>& m, const char* name) {
+	typedef typename G::Word Word;
+	constexpr int MEMSIZE  = G::MEMSIZE;
+	constexpr int LASTADDR = G::LASTADDR;
+	std::string buf;
+	{
+		std::ifstream in(name, std::ios::binary);
+		if (!in) {
+			std::cerr << name << ": open error" << std::endl;
+			return scERROR;
+		}
+		// rdbuf, а не tellg: скрипт может прийти из канала
+		std::stringstream text;
+		if (in.peek() != EOF) text << in.rdbuf();
+		if (in.bad() || text.fail()) {
+			std::cerr << name << ": read error" << std::endl;
+			return scERROR;
+		}
+		buf = text.str();
+	}
+	m.Reset();
+	m.lastRun = PerfStats();
+	m.lastMeasured = false;
+	m.perfOn = false;
+	m.fileName = "program.bin";
+	int result {scOK};
+	int lineNo {0};
+	std::string_view text(buf);
+	auto error = [&](const char* msg) {
+		std::cerr << name << ":" << lineNo << ": " << msg << std::endl;
+		result = scERROR;
+	};
+	while (!text.empty() && result != scERROR) {
+		std::string_view line = NextLine(text);
+		lineNo++;
+		std::string_view rest = line;
+		std::string_view cmd = NextToken(rest);
+		if (cmd.empty() || cmd[0] == ';' || cmd[0] == '#') continue;
+		std::string_view arg[4];
+		long long v[4] = {0, 0, 0, 0};
+		int n {0};
+		if (!SameText(cmd, "?"))
+			for (std::string_view t = NextToken(rest); !t.empty() && n < 4; t = NextToken(rest)) arg[n++] = t;
+		switch (cmd.size() == 1 ? toupper(cmd[0]) : 0) {
+			case 'Q':
+				return result;
+			case 'G':
+				// 0 означал бы запуск без ограничения - скрипт не должен зависать
+				if (n > 0 && (!InputNumber(arg[0], v[0]) || v[0] < 1)) error("bad step limit");
+				else {
+					m.Do(n > 0 ? v[0] : SCRIPT_STEPS);
+					if (m.perfOn) m.lastRun.Print(std::cout);
+				}
+				break;
+			case 'T':
+				m.Trace();
+				std::cout << std::endl;
+				break;
+			case 'D':
+				m.DumpMem();
+				std::cout << std::endl;
+				break;
+			case 'U':
+				m.Unassemble();
+				break;
+			case 'R':
+				m.ViewRegs();
+				std::cout << std::endl;
+				break;
+			case 'P':
+				if (n > 1 || (n == 1 && !SameText(arg[0], "ON") && !SameText(arg[0], "OFF"))) error("P [ON|OFF]");
+				else if (n == 1) m.perfOn = SameText(arg[0], "ON");
+				else if (m.lastRun.runs == 0) std::cout << "No run yet" << std::endl;
+				else if (!m.lastMeasured) std::cout << "Counters were off during the last run" << std::endl;
+				else m.lastRun.Print(std::cout);
+				break;
+			case '!':
+				m.LoadTest();
+				break;
+			case 'N':
+				if (n != 1) error("file name expected");
+				else m.fileName = std::string(arg[0]) + ".bin";
+				break;
+			case 'L':
+			case 'W': {
+				std::string file = n > 0 ? std::string(arg[0]) : m.fileName;
+				FILE* fptr = fopen(file.c_str(), toupper(cmd[0]) == 'L' ? "rb" : "wb");
+				size_t done {0};
+				if (fptr != NULL) {
+					if (toupper(cmd[0]) == 'L') done = fread(m.memory, sizeof(Word), MEMSIZE, fptr);
+					else done = fwrite(m.memory, sizeof(Word), MEMSIZE, fptr);
+					fclose(fptr);
+				}
+				if (done != MEMSIZE) error("file error");
+				break;
+			}
+			case 'F': {
+				Word value {0};
+				if (n < 1 || n > 3 || !m.ParseWord(std::string(arg[0]), value)) error("F value [from] [to]");
+				else {
+					v[1] = 0;
+					v[2] = LASTADDR;
+					for (int i = 1; i < n; i++)
+						if (!InputNumber(arg[i], v[i]) || v[i] < 0 || v[i] > LASTADDR) error("bad address");
+					if (result != scERROR) m.Fill(value, std::min(v[1], v[2]), std::max(v[1], v[2]));
+				}
+				break;
+			}
+			case 'M':
+				if (n != 3) error("M from to target");
+				else {
+					for (int i = 0; i < 3; i++)
+						if (!InputNumber(arg[i], v[i]) || v[i] < 0 || v[i] > LASTADDR) error("bad address");
+					if (result != scERROR) m.Move(std::min(v[0], v[1]), std::max(v[0], v[1]), v[2]);
+				}
+				break;
+			case 'H':
+				if (n != 2 || !InputNumber(arg[0], v[0]) || !InputNumber(arg[1], v[1])) error("H p1 p2");
+				else std::cout << v[0] + v[1] << " " << v[0] - v[1] << std::endl;
+				break;
+			case 'X':
+				if (n != 2 || !InputNumber(arg[1], v[1])) error("X reg value");
+				else if (SameText(arg[0], "IR")) m.IR = Word(v[1]);
+				else if (SameText(arg[0], "IP") && v[1] >= 0 && v[1] <= LASTADDR) m.IP = Word(v[1]);
+				else if (SameText(arg[0], "OV")) m.OV = v[1] != 0;
+				else if (SameText(arg[0], "D0")) m.D0 = v[1] != 0;
+				else error("bad register");
+				break;
+			case 'A':
+			case 'S': {
+				bool assemble = toupper(cmd[0]) == 'A';
+				if (n > 1 || (n == 1 && (!InputNumber(arg[0], v[0]) || v[0] < 0 || v[0] > LASTADDR))) {
+					error("bad address");
+					break;
+				}
+				int org = v[0];
+				while (!text.empty() && result != scERROR) {
+					std::string_view block = NextLine(text);
+					lineNo++;
+					std::string_view t = block;
+					std::string_view first = NextToken(t);
+					if (first.empty()) break;
+					if (first[0] == ';' || first[0] == '#') continue;
+					Word word {0};
+					if (assemble) {
+						if (!AssembleLine<G>(block, word)) error("Illegal instruction");
+					}
+					else if (!NextToken(t).empty() || !m.ParseWord(std::string(first), word)) error("bad value");
+					m.memory[org] = word;
+					org++;
+					if (org > LASTADDR) org = 0; //заворачиваем адреса
+				}
+				break;
+			}
+			case '?': {
+				std::string_view what = NextToken(rest);
+				long long actual[3] = {0, 0, 0};
+				int count {1};
+				if (SameText(what, "IR")) actual[0] = m.IR;
+				else if (SameText(what, "IP")) actual[0] = m.IP;
+				else if (SameText(what, "OV")) actual[0] = m.OV;
+				else if (SameText(what, "D0")) actual[0] = m.D0;
+				else if (SameText(what, "STEPS")) actual[0] = (long long)m.lastRun.steps;
+				else if (SameText(what, "OUT")) {
+					count = 3;
+					for (int i = 0; i < 3; i++) actual[i] = m.PR[i];
+				}
+				else if (what.size() > 1 && (what[0] == 'M' || what[0] == 'm') && ParseNumber(what.substr(1), 10, v[0])
+				         && v[0] >= 0 && v[0] <= LASTADDR) actual[0] = m.memory[v[0]];
+				else {
+					error("bad assertion");
+					break;
+				}
+				for (n = 0; n < 4; n++) {
+					std::string_view t = NextToken(rest);
+					if (t.empty()) break;
+					if (n == count || !InputNumber(t, v[n])) n = 4;
+				}
+				if (n != count) {
+					error("bad assertion");
+					break;
+				}
+				bool ok {true};
+				bool words = !SameText(what, "STEPS"); //слова сравниваются по модулю: 0FFFF == -1
+				for (int i = 0; i < count; i++)
+					ok = ok && (words ? Word(actual[i]) == Word(v[i]) : actual[i] == v[i]);
+				if (!ok) {
+					std::cerr << name << ":" << lineNo << ": assertion failed: " << what << " is";
+					for (int i = 0; i < count; i++) std::cerr << " " << actual[i];
+					std::cerr << std::endl;
+					result = scFAILED;
+				}
+				break;
+			}
+			default:
+				error("unknown command");
+		}
+	}
+	return result;
+}
+
+template <class G>
+static int RunScriptFiles(int count, char** names) {
+	TINYAC<G> m(false);
+	int failed {0};
+	int errors {0};
+	for (int i = 0; i < count; i++) {
+		int rc = RunScript(m, names[i]);
+		if (rc == scFAILED) failed++;
+		if (rc == scERROR) errors++;
+	}
+	if (count > 1) std::cerr << count << " scripts, " << failed << " failed, " << errors << " errors" << std::endl;
+	if (errors > 0) return 2;
+	return failed > 0 ? 1 : 0;
+}
+
+int RunScripts(int argc, char** argv) {
+	int arg {2};
+	int words {8};
+	if (argc > arg + 1 && std::string(argv[arg]) == "-m") {
+		words = std::atoi(argv[arg + 1]);
+		arg += 2;
+	}
+	if (argc <= arg) {
+		std::cerr << "Usage: tinyac script [-m <words>] <file> [<file>...]" << std::endl;
+		return 2;
+	}
+	switch (words) {
+		case Classic::MEMSIZE:    return RunScriptFiles<Classic>(argc - arg, argv + arg);
+		case Extended::MEMSIZE:   return RunScriptFiles<Extended>(argc - arg, argv + arg);
+		case Extended4K::MEMSIZE: return RunScriptFiles<Extended4K>(argc - arg, argv + arg);
+	}
+	std::cerr << "Memory size must be 8, 256 or 4096 words" << std::endl;
+	return 2;
+}
+
+/*
+	Run server, classic 8-word machine only.
+	Listens on a Unix domain socket; a client may send any
+	number of requests without waiting for answers. Requests are run
+	by a pool of workers, each answer is sent as soon as it is ready
+	and carries the request id, so answers may come out of order.
+	Every connection has its own writer thread and answer queue, so
+	workers never wait for a client. At most SRV_INFLIGHT requests of
+	one connection may be unanswered; then the server stops reading
+	from it until the client takes its answers, so a slow client only
+	slows itself.
+
+	All numbers are little-endian. A frame is u32 length of the rest,
+	u8 type, u32 id and the body:
+	type 1, run request:  u64 steps (0 - server limit), u32 time limit
+	                      in ms (0 - default), u8 IP, u8 flags (1 - OV,
+	                      2 - D0), 8 x i16 memory
+	type 1, run answer:   u8 status (0 - stopped, 1 - step limit,
+	                      2 - time limit), u64 steps, u8 IP, u8 flags,
+	                      i16 IR, 3 x i16 PRST output, 8 x i16 memory,
+	                      u32 latency in microseconds from queuing
+	                      the request until the answer is ready (not
+	                      counting the wait for the writer)
+	type 2, metrics:      empty request; answer - u32 queue depth,
+	                      u64 served, u32 latency p50, p90, p99 and
+	                      max in microseconds over the last requests
+	type 0, error answer: empty, the connection is closed after it
+*/
+
+#define SRV_STEPS     100000000ULL // step limit for one request
+#define SRV_TIME_MS   1000         // default time limit for one request
+#define SRV_CHUNK     (1 << 20)    // steps between time limit checks
+#define SRV_LATENCIES 4096         // latencies kept for percentiles
+#define SRV_FRAME     64           // longest request frame
+#define SRV_INFLIGHT  256          // unanswered requests of one connection
+
+#ifdef HAVE_UNIX_SOCKETS
+
+typedef std::vector<uint8_t> Frame;
+
+static void Put(Frame& f, uint64_t v, int bytes) {
+	for (int i = 0; i < bytes; i++) f.push_back(uint8_t(v >> (8 * i)));
+}
+
+// frame length is written when the frame is complete
+static void Seal(Frame& f) {
+	uint32_t size = f.size() - 4;
+	for (int i = 0; i < 4; i++) f[i] = uint8_t(size >> (8 * i));
+}
+
+static uint64_t Get(const uint8_t*& p, int bytes) {
+	uint64_t v {0};
+	for (int i = 0; i < bytes; i++) v |= uint64_t(*p++) << (8 * i);
+	return v;
+}
+
+// A request counts as in flight from Accept until its answer is
+// written or dropped; the writer thread ends when nothing is left.
+struct Connection {
+	int fd;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<Frame> outbox;
+	int inFlight {0};
+	bool readDone {false}; //клиент закрыл соединение или прислал ошибку
+	bool closed {false};   //отправлен ответ об ошибке, дальше ничего не пишем
+	bool broken {false};   //запись не удалась
+	explicit Connection(int f) : fd(f) {}
+	~Connection() { close(fd); }
+	bool Accept();
+	void Post(Frame f);
+	void Finish();
+	void Close(Frame f);
+	void Writer();
+};
+
+// waits for a free in-flight slot, false if the connection is broken
+bool Connection::Accept() {
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return inFlight < SRV_INFLIGHT || broken; });
+	if (broken) return false;
+	inFlight++;
+	return true;
+}
+
+// answer to an accepted request
+void Connection::Post(Frame f) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (closed || broken) {
+		inFlight--; //ответ уже некому отправить
+		changed.notify_all();
+		return;
 	}
+	outbox.push_back(std::move(f));
+	changed.notify_all();
+}
+
+// no more requests, the writer ends after the last answer
+void Connection::Finish() {
+	std::lock_guard<std::mutex> guard(lock);
+	readDone = true;
+	changed.notify_all();
 }
 
-void TINYAC::Compute() {
-	int first  {0};
-	int second {0};
-	if(parsedDir.size() >= 3) {
-			if(parsedDir[1][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[1];
-					ss >> b;
-					first = b;
+// error answer, the connection is closed after it
+void Connection::Close(Frame f) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!broken) {
+		outbox.push_back(std::move(f));
+		inFlight++;
+	}
+	readDone = true;
+	closed = true;
+	changed.notify_all();
+}
+
+void Connection::Writer() {
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		changed.wait(guard, [this] { return !outbox.empty() || (readDone && (inFlight == 0 || closed)); });
+		if (outbox.empty()) break;
+		Frame f = std::move(outbox.front());
+		outbox.pop_front();
+		guard.unlock();
+		bool ok {true};
+		for (size_t done = 0; ok && done < f.size();) {
+			ssize_t n = write(fd, f.data() + done, f.size() - done);
+			if (n <= 0) ok = false;
+			else done += n;
+		}
+		guard.lock();
+		inFlight--;
+		if (!ok) {
+			broken = true;
+			inFlight -= outbox.size();
+			outbox.clear();
+			changed.notify_all();
+			break;
+		}
+		changed.notify_all();
+	}
+	guard.unlock();
+	shutdown(fd, SHUT_RDWR); //читатель выходит из read
+}
+
+static bool ReadAll(int fd, uint8_t* buf, size_t size) {
+	for (size_t done = 0; done < size;) {
+		ssize_t n = read(fd, buf + done, size - done);
+		if (n <= 0) return false;
+		done += n;
+	}
+	return true;
+}
+
+struct Job {
+	std::shared_ptr<Connection> conn;
+	uint32_t id;
+	unsigned long long maxSteps;
+	uint32_t timeMs;
+	Machine<Classic> m;
+	std::chrono::steady_clock::time_point queued;
+};
+
+class RunServer {
+	public:
+		explicit RunServer(int workers);
+		int Listen(const char* path);
+	private:
+		std::mutex lock;
+		std::condition_variable ready;
+		std::deque<Job> queue;
+		std::vector<uint32_t> latency;
+		size_t latencyPos {0};
+		unsigned long long served {0};
+		int workers;
+		void Worker();
+		void Reader(std::shared_ptr<Connection> conn);
+		Frame Metrics(uint32_t id);
+};
+
+RunServer::RunServer(int w) : workers(w) {
+	latency.reserve(SRV_LATENCIES);
+}
+
+int RunServer::Listen(const char* path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		std::cerr << path << ": socket path too long" << std::endl;
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		// старый сокет прошлого запуска удаляем, любой другой файл - нет
+		if (!S_ISSOCK(st.st_mode)) {
+			std::cerr << path << ": exists and is not a socket" << std::endl;
+			return 1;
+		}
+		unlink(path);
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+		std::cerr << path << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 0; i < workers; i++) std::thread(&RunServer::Worker, this).detach();
+	std::cout << "Serving on " << path << " with " << workers << " workers" << std::endl;
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			std::cerr << "accept: " << strerror(errno) << std::endl;
+			return 1;
+		}
+		auto conn = std::make_shared<Connection>(client);
+		std::thread(&Connection::Writer, conn).detach();
+		std::thread(&RunServer::Reader, this, conn).detach();
+	}
+}
+
+// reads frames of one client until it closes the connection
+void RunServer::Reader(std::shared_ptr<Connection> conn) {
+	uint8_t buf[SRV_FRAME];
+	for (;;) {
+		const uint8_t* p = buf;
+		if (!ReadAll(conn->fd, buf, 4)) {
+			conn->Finish();
+			return;
+		}
+		uint32_t size = Get(p, 4);
+		if (size < 5 || size > SRV_FRAME || !ReadAll(conn->fd, buf, size)) break;
+		p = buf;
+		int type = Get(p, 1);
+		uint32_t id = Get(p, 4);
+		// не читаем дальше, пока клиент не заберёт ответы
+		if (type == 2 && size == 5) {
+			if (!conn->Accept()) return;
+			conn->Post(Metrics(id));
+			continue;
+		}
+		if (type != 1 || size != 5 + 8 + 4 + 2 + 2 * Classic::MEMSIZE) break;
+		Job job;
+		job.conn = conn;
+		job.id = id;
+		job.maxSteps = Get(p, 8);
+		job.timeMs = Get(p, 4);
+		job.m.IP = Get(p, 1) & Classic::LASTADDR;
+		int flags = Get(p, 1);
+		job.m.OV = flags & 1;
+		job.m.D0 = flags & 2;
+		for (int i = 0; i < Classic::MEMSIZE; i++) job.m.memory[i] = Classic::Word(Get(p, 2));
+		if (job.maxSteps == 0 || job.maxSteps > SRV_STEPS) job.maxSteps = SRV_STEPS;
+		if (job.timeMs == 0) job.timeMs = SRV_TIME_MS;
+		if (!conn->Accept()) return;
+		job.queued = std::chrono::steady_clock::now();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back(std::move(job));
+		}
+		ready.notify_one();
+	}
+	Frame err;
+	Put(err, 0, 4);
+	Put(err, 0, 1);
+	Put(err, 0, 4);
+	Seal(err);
+	conn->Close(err);
+}
+
+void RunServer::Worker() {
+	for (;;) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			ready.wait(guard, [this] { return !queue.empty(); });
+			job = std::move(queue.front());
+			queue.pop_front();
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(job.timeMs);
+		unsigned long long steps {0};
+		int status {0};
+		for (;;) {
+			bool halted = RunThreaded(job.m, std::min<unsigned long long>(job.maxSteps - steps, SRV_CHUNK));
+			steps += job.m.steps;
+			if (halted) break;
+			if (steps >= job.maxSteps) {
+				status = 1;
+				break;
 			}
-			else first = std::stoi(parsedDir[1]);
-			
-			if(parsedDir[2][0]=='0') { //hex
-				int b {0};
-					std::stringstream ss;
-					ss << std::hex << parsedDir[2];
-					ss >> b;
-					second = b;
+			if (std::chrono::steady_clock::now() >= deadline) {
+				status = 2;
+				break;
 			}
-			else second = std::stoi(parsedDir[2]);
-		std::cout << "+ "<<std::setw(6) << std::setfill('0') << std::hex << first+second <<':'
-		      << std::setw(6) << std::setfill(' ') << std::dec << first+second << "D\n";
-		std::cout << "- "<<std::setw(6) << std::setfill('0') << std::hex << first-second <<':'
-		      << std::setw(6) << std::setfill(' ') << std::dec << first-second << "D\n";
+		}
+		Frame f;
+		Put(f, 0, 4);
+		Put(f, 1, 1);
+		Put(f, job.id, 4);
+		Put(f, status, 1);
+		Put(f, steps, 8);
+		Put(f, job.m.IP, 1);
+		Put(f, (job.m.OV ? 1 : 0) | (job.m.D0 ? 2 : 0), 1);
+		Put(f, uint16_t(job.m.IR), 2);
+		for (auto w : job.m.PR) Put(f, uint16_t(w), 2);
+		for (auto w : job.m.memory) Put(f, uint16_t(w), 2);
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job.queued).count();
+		Put(f, uint32_t(us), 4);
+		Seal(f);
+		job.conn->Post(std::move(f));
+		std::lock_guard<std::mutex> guard(lock);
+		if (latency.size() < SRV_LATENCIES) latency.push_back(uint32_t(us));
+		else latency[latencyPos] = uint32_t(us);
+		latencyPos = (latencyPos + 1) % SRV_LATENCIES;
+		served++;
+	}
+}
+
+Frame RunServer::Metrics(uint32_t id) {
+	std::vector<uint32_t> sorted;
+	Frame f;
+	Put(f, 0, 4);
+	Put(f, 2, 1);
+	Put(f, id, 4);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		Put(f, queue.size(), 4);
+		Put(f, served, 8);
+		sorted = latency;
+	}
+	std::sort(sorted.begin(), sorted.end());
+	for (int pct : {50, 90, 99, 100})
+		Put(f, sorted.empty() ? 0 : sorted[(sorted.size() - 1) * pct / 100], 4);
+	Seal(f);
+	return f;
+}
+
+int Serve(int argc, char** argv) {
+	if (argc < 3 || argc > 4) {
+		std::cerr << "Usage: tinyac serve <socket> [<workers>]" << std::endl;
+		return 2;
 	}
+	int workers = argc == 4 ? std::atoi(argv[3]) : int(std::thread::hardware_concurrency());
+	if (workers < 1) workers = 1;
+	RunServer server(workers);
+	return server.Listen(argv[2]);
+}
+
+#else
+
+int Serve(int argc, char** argv) {
+	std::cerr << "Run server needs Unix domain sockets, not supported on this system" << std::endl;
+	return 2;
 }
+
+#endif